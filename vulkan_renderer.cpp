@@ -5,6 +5,8 @@
 #include <iostream>
 #include <vector>
 #include <map>
+#include <cstdlib>
+#include <cstdint>
 
 using namespace chicken;
 
@@ -41,6 +43,40 @@ static VKAPI_ATTR VkBool32 VKAPI_CALL vk_debug_callback(
 
    chickenRenderer::chickenRenderer()
 {
+    //Set CHICKEN_RECORD_EVERY_FRAME to fall back to recording a fresh command buffer each frame
+    reuseCommandBuffers = std::getenv("CHICKEN_RECORD_EVERY_FRAME") == nullptr;
+    //Set CHICKEN_FRAME_STATS to print the average CPU frame time every 1000 frames and render scale changes
+    printFrameStats = std::getenv("CHICKEN_FRAME_STATS") != nullptr;
+    cpuFrameTime = std::chrono::steady_clock::duration::zero();
+    waitFrameTime = std::chrono::steady_clock::duration::zero();
+    timedFrames = 0;
+
+    //GPU frame time budget in milliseconds, overridable with CHICKEN_GPU_BUDGET_MS
+    gpuBudgetMs = 16.0f;
+    const char *budget = std::getenv("CHICKEN_GPU_BUDGET_MS");
+    if (budget)
+    {
+        char *end = nullptr;
+        float value = std::strtof(budget, &end);
+        if (end != budget && *end == '\0' && value > 0.0f)
+        {
+            gpuBudgetMs = value;
+        }
+        else
+        {
+            std::cout << "Ignoring invalid CHICKEN_GPU_BUDGET_MS \"" << budget << "\", using 16 ms \n";
+        }
+    }
+    gpuFrameMs = 0.0f;
+    renderScale = 1.0f;
+    framesSinceScale = 0;
+
+    frameSlot = 0;
+    for (uint32_t i = 0; i < framesInFlight; i++)
+    {
+        frameValues[i] = 0;
+    }
+
     chickenRenderer::createInstance();
     chickenRenderer::createSurface();
     chickenRenderer::pickPhysicalDevice();
@@ -50,9 +86,32 @@ static VKAPI_ATTR VkBool32 VKAPI_CALL vk_debug_callback(
 
 chickenRenderer::~chickenRenderer()
 {
+    //waits for the last submission, so nothing below is still in use by the GPU
+    sync.destroy();
+
+    for (uint32_t i = 0; i < framesInFlight; i++)
+    {
+        vkDestroySemaphore(device, acquireSemaphores[i], nullptr);
+    }
+    for (VkSemaphore semaphore : submitSemaphores)
+    {
+        vkDestroySemaphore(device, semaphore, nullptr);
+    }
+    vkDestroyQueryPool(device, timestampPool, nullptr);
+    //also frees the command buffers allocated from it
+    vkDestroyCommandPool(device, commandPool, nullptr);
+    vkDestroyPipeline(device, pipeline, nullptr);
+    vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+    vkDestroyFramebuffer(device, offscreenFramebuffer, nullptr);
+    vkDestroyRenderPass(device, renderpass, nullptr);
+    vkDestroyImageView(device, offscreenView, nullptr);
+    vkDestroyImage(device, offscreenImage, nullptr);
+    vkFreeMemory(device, offscreenMemory, nullptr);
+    vkDestroySwapchainKHR(device, swapchain, nullptr);
+
+    vkDestroyDevice(device, nullptr);
     vkDestroySurfaceKHR(instance, surface, nullptr);
     vkDestroyInstance(instance, nullptr);
-    vkDestroyDevice(device, nullptr);
 }
 
 void chickenRenderer::createInstance()
@@ -63,7 +122,15 @@ void chickenRenderer::createInstance()
     appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
     appInfo.pEngineName = "No Engine";
     appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-    appInfo.apiVersion = VK_API_VERSION_1_0;
+
+    //Ask for 1.2 when the loader has it so timeline semaphores can be used
+    instanceVersion = VK_API_VERSION_1_0;
+    auto vkEnumerateInstanceVersion = (PFN_vkEnumerateInstanceVersion)vkGetInstanceProcAddr(nullptr, "vkEnumerateInstanceVersion");
+    if (vkEnumerateInstanceVersion)
+    {
+        vkEnumerateInstanceVersion(&instanceVersion);
+    }
+    appInfo.apiVersion = instanceVersion >= VK_API_VERSION_1_2 ? VK_API_VERSION_1_2 : VK_API_VERSION_1_0;
 
 
 
@@ -193,20 +260,45 @@ void chickenRenderer::createLogicalDevice()
     deviceInfo.pQueueCreateInfos = &queueInfo;
     deviceInfo.queueCreateInfoCount = 1;
 
+    //Timeline semaphores need a 1.2 instance and device, otherwise chickenSync falls back to fences
+    VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures = {};
+    timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+    timelineSupported = false;
+    {
+        VkPhysicalDeviceProperties props;
+        vkGetPhysicalDeviceProperties(gpuIntel, &props);
+
+        auto vkGetPhysicalDeviceFeatures2 = (PFN_vkGetPhysicalDeviceFeatures2)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceFeatures2");
+
+        if (instanceVersion >= VK_API_VERSION_1_2 && props.apiVersion >= VK_API_VERSION_1_2 && vkGetPhysicalDeviceFeatures2)
+        {
+            VkPhysicalDeviceFeatures2 features = {};
+            features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+            features.pNext = &timelineFeatures;
+            vkGetPhysicalDeviceFeatures2(gpuIntel, &features);
+
+            timelineSupported = timelineFeatures.timelineSemaphore == VK_TRUE;
+        }
+
+        if (timelineSupported)
+        {
+            timelineFeatures.pNext = nullptr;
+            deviceInfo.pNext = &timelineFeatures;
+        }
+    }
+
     if (vkCreateDevice(gpuIntel, &deviceInfo, nullptr, &device) != VK_SUCCESS)
     {
         std::cout << "Failed to create device. \n";
     }
 
     vkGetDeviceQueue(device, graphicsIdx, 0, &graphicsQueue);
+
+    sync.init(device, timelineSupported);
 }
 
 void chickenRenderer::createSwapChain()
 {
-    int width, height;
-    glfwGetWindowSize(wndClass.window, &width, &height);
-    screensize.width = width;
-    screensize.height = height;
     uint32_t formatCount = 0;
     VkSurfaceFormatKHR surfaceFormats[10];
     vkGetPhysicalDeviceSurfaceFormatsKHR(gpuIntel, surface, &formatCount, 0);
@@ -227,15 +319,52 @@ void chickenRenderer::createSwapChain()
     VkResult res = vkGetPhysicalDeviceSurfaceCapabilitiesKHR(gpuIntel, surface, &surfaceCapibilities);
     uint32_t imgCount = 0;
     imgCount = surfaceCapibilities.minImageCount + 1;
-    imgCount > surfaceCapibilities.maxImageCount ? imgCount - 1: imgCount;
+    //maxImageCount of 0 means there is no upper limit
+    if (surfaceCapibilities.maxImageCount > 0 && imgCount > surfaceCapibilities.maxImageCount)
+    {
+        imgCount = surfaceCapibilities.maxImageCount;
+    }
+
+    //Size everything from the swapchain extent, which can differ from the window size on scaled displays
+    if (surfaceCapibilities.currentExtent.width != UINT32_MAX)
+    {
+        screensize = surfaceCapibilities.currentExtent;
+    }
+    else
+    {
+        int width, height;
+        glfwGetFramebufferSize(wndClass.window, &width, &height);
+        screensize.width = width;
+        screensize.height = height;
+    }
+
+    //the scene is blitted into the swapchain image rather than rendered into it
+    if (!(surfaceCapibilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT))
+    {
+        throw std::runtime_error("swapchain images do not support transfer destination usage!");
+    }
+
+    {
+        VkFormatProperties formatProps;
+        vkGetPhysicalDeviceFormatProperties(gpuIntel, surfaceFormat.format, &formatProps);
+        VkFormatFeatureFlags features = formatProps.optimalTilingFeatures;
+
+        blitSupported = (features & VK_FORMAT_FEATURE_BLIT_SRC_BIT) && (features & VK_FORMAT_FEATURE_BLIT_DST_BIT);
+        blitFilter = (features & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT) ? VK_FILTER_LINEAR : VK_FILTER_NEAREST;
+
+        if (!blitSupported)
+        {
+            std::cout << "Swapchain format does not support blits, dynamic resolution disabled \n" << std::endl;
+        }
+    }
 
     VkSwapchainCreateInfoKHR scInfo = {};
     scInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
-    scInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    scInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
     scInfo.surface = surface;
     scInfo.imageFormat = surfaceFormat.format;
     scInfo.preTransform = surfaceCapibilities.currentTransform;
-    scInfo.imageExtent = surfaceCapibilities.currentExtent;
+    scInfo.imageExtent = screensize;
     scInfo.minImageCount = imgCount;
     scInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
     scInfo.imageArrayLayers = 1;
@@ -250,24 +379,57 @@ void chickenRenderer::createSwapChain()
     }
 
 
+    //the driver may create more images than requested, so size per-image state from the actual count
     vkGetSwapchainImagesKHR(device, swapchain, &scImgCount, 0);
-    vkGetSwapchainImagesKHR(device, swapchain, &scImgCount, scImages);
+    scImages.resize(scImgCount);
+    vkGetSwapchainImagesKHR(device, swapchain, &scImgCount, scImages.data());
 
-    //Create image scImageViews
+    //Offscreen color target, allocated once at full size; only the renderExtent corner is drawn to
     {
+        VkImageCreateInfo imageInfo = {};
+        imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        imageInfo.imageType = VK_IMAGE_TYPE_2D;
+        imageInfo.format = surfaceFormat.format;
+        imageInfo.extent.width = screensize.width;
+        imageInfo.extent.height = screensize.height;
+        imageInfo.extent.depth = 1;
+        imageInfo.mipLevels = 1;
+        imageInfo.arrayLayers = 1;
+        imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+        imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+        imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+        if (vkCreateImage(device, &imageInfo, 0, &offscreenImage) != VK_SUCCESS)
+        {
+            std::cout << "Failed to create offscreen image \n" << std::endl;
+        }
+
+        VkMemoryRequirements memReqs;
+        vkGetImageMemoryRequirements(device, offscreenImage, &memReqs);
+
+        VkMemoryAllocateInfo memInfo = {};
+        memInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        memInfo.allocationSize = memReqs.size;
+        memInfo.memoryTypeIndex = findMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+        if (vkAllocateMemory(device, &memInfo, 0, &offscreenMemory) != VK_SUCCESS)
+        {
+            std::cout << "Failed to allocate offscreen image memory \n" << std::endl;
+        }
+        vkBindImageMemory(device, offscreenImage, offscreenMemory, 0);
+
         VkImageViewCreateInfo viewInfo = {};
         viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        viewInfo.image = offscreenImage;
         viewInfo.format = surfaceFormat.format;
         viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
         viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
         viewInfo.subresourceRange.layerCount = 1;
         viewInfo.subresourceRange.levelCount = 1;
+        vkCreateImageView(device, &viewInfo, 0, &offscreenView);
 
-        for (int i = 0; i < scImgCount; i++)
-        {
-            viewInfo.image = scImages[i];
-            vkCreateImageView(device, &viewInfo, 0, &scImageViews[i]);
-        }
+        renderExtent = screensize;
     }
 
     //RenderPass
@@ -275,7 +437,7 @@ void chickenRenderer::createSwapChain()
         VkAttachmentDescription attachment = {};
         attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
         attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        attachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+        attachment.finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
         attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
         attachment.samples = VK_SAMPLE_COUNT_1_BIT;
         attachment.format = surfaceFormat.format;
@@ -302,6 +464,24 @@ void chickenRenderer::createSwapChain()
         rpInfo.subpassCount = 1;
         rpInfo.pSubpasses = &subpassDesc;
 
+        //order the draw after the previous blit out of the target, and the next blit after the draw
+        VkSubpassDependency dependencies[2] = {};
+        dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+        dependencies[0].dstSubpass = 0;
+        dependencies[0].srcStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+        dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+
+        dependencies[1].srcSubpass = 0;
+        dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+        dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+        dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        dependencies[1].dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        dependencies[1].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+        rpInfo.pDependencies = dependencies;
+        rpInfo.dependencyCount = sizeof(dependencies) / sizeof(dependencies[0]);
+
         vkCreateRenderPass(device, &rpInfo, 0, &renderpass);
     }
 
@@ -314,12 +494,8 @@ void chickenRenderer::createSwapChain()
         fbInfo.renderPass = renderpass;
         fbInfo.layers = 1;
         fbInfo.attachmentCount = 1;
-
-        for (int i = 0; i < scImgCount; i++)
-        {
-            fbInfo.pAttachments = &scImageViews[i];
-            vkCreateFramebuffer(device, &fbInfo, 0, &framebuffers[i]);
-        }
+        fbInfo.pAttachments = &offscreenView;
+        vkCreateFramebuffer(device, &fbInfo, 0, &offscreenFramebuffer);
     }
 
     //Pipeline Layout
@@ -464,40 +640,167 @@ void chickenRenderer::createSwapChain()
     {
         VkCommandPoolCreateInfo poolInfo = {};
         poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        //needed so a single dirty command buffer can be reset and re-recorded
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
         poolInfo.queueFamilyIndex = graphicsIdx;
         vkCreateCommandPool(device, &poolInfo, 0, &commandPool);
     }
 
+    //Command buffers, one per swapchain image
+    {
+        VkCommandBufferAllocateInfo allocInfo = {};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = scImgCount;
+        allocInfo.commandPool = commandPool;
+
+        commandBuffers.resize(scImgCount);
+        cmdDirty.resize(scImgCount);
+        cmdPipeline.resize(scImgCount, VK_NULL_HANDLE);
+        cmdExtent.resize(scImgCount, VkExtent2D{0, 0});
+        cmdRenderExtent.resize(scImgCount, VkExtent2D{0, 0});
+
+        if(vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data()) != VK_SUCCESS)
+        {
+            std::cout << "Failed to allocate command buffers \n" << std::endl;
+        }
+
+        markCommandBuffersDirty();
+        imageValues.assign(scImgCount, 0);
+    }
+
     {
         VkSemaphoreCreateInfo semainfo = {};
         semainfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-        vkCreateSemaphore(device, &semainfo, 0, &acquireSemaphore);
-        vkCreateSemaphore(device, &semainfo, 0, &submitSemaphore);
+        for (uint32_t i = 0; i < framesInFlight; i++)
+        {
+            vkCreateSemaphore(device, &semainfo, 0, &acquireSemaphores[i]);
+        }
+
+        submitSemaphores.resize(scImgCount);
+        for (uint32_t i = 0; i < scImgCount; i++)
+        {
+            vkCreateSemaphore(device, &semainfo, 0, &submitSemaphores[i]);
+        }
+    }
+
+    //Timestamp queries bracketing each frame, used to drive renderScale
+    {
+        VkPhysicalDeviceProperties props;
+        vkGetPhysicalDeviceProperties(gpuIntel, &props);
+        timestampPeriod = props.limits.timestampPeriod;
+
+        uint32_t queueFamilyCount = 0;
+        VkQueueFamilyProperties queueProps[10];
+        vkGetPhysicalDeviceQueueFamilyProperties(gpuIntel, &queueFamilyCount, 0);
+        vkGetPhysicalDeviceQueueFamilyProperties(gpuIntel, &queueFamilyCount, queueProps);
+        uint32_t validBits = queueProps[graphicsIdx].timestampValidBits;
+        timestampsSupported = validBits != 0;
+        timestampMask = validBits >= 64 ? UINT64_MAX : (((uint64_t)1 << validBits) - 1);
+
+        VkQueryPoolCreateInfo queryInfo = {};
+        queryInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        queryInfo.queryCount = 2 * scImgCount;
+        if (vkCreateQueryPool(device, &queryInfo, 0, &timestampPool) != VK_SUCCESS)
+        {
+            std::cout << "Failed to create timestamp query pool \n" << std::endl;
+            timestampsSupported = false;
+        }
+
+        if (!timestampsSupported)
+        {
+            std::cout << "GPU timestamps unavailable, dynamic resolution disabled \n" << std::endl;
+        }
     }
 
 }
 
-bool chickenRenderer::vk_render()
+uint32_t chickenRenderer::findMemoryType(uint32_t typeBits, VkMemoryPropertyFlags properties)
 {
+    VkPhysicalDeviceMemoryProperties memProps;
+    vkGetPhysicalDeviceMemoryProperties(gpuIntel, &memProps);
 
+    for (uint32_t i = 0; i < memProps.memoryTypeCount; i++)
+    {
+        if ((typeBits & (1 << i)) && (memProps.memoryTypes[i].propertyFlags & properties) == properties)
+        {
+            return i;
+        }
+    }
 
-    uint32_t imgIdx;
-    vkAcquireNextImageKHR(device, swapchain, 0, acquireSemaphore, 0,&imgIdx);
+    throw std::runtime_error("failed to find suitable memory type!");
+}
 
-    VkCommandBuffer cmd;
+void chickenRenderer::updateRenderScale(uint32_t imgIdx)
+{
+    if (!timestampsSupported || !blitSupported)
+    {
+        return;
+    }
 
-    VkCommandBufferAllocateInfo allocInfo = {};
-    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocInfo.commandBufferCount = 1;
-    allocInfo.commandPool = commandPool;
-    if(vkAllocateCommandBuffers(device, &allocInfo, &cmd) != VK_SUCCESS)
+    uint64_t timestamps[2];
+    if (vkGetQueryPoolResults(device, timestampPool, 2 * imgIdx, 2, sizeof(timestamps), timestamps,
+                              sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
     {
-        std::cout << "Failed to allocate command buffer \n" << std::endl;
+        return;
     }
 
+    //only timestampValidBits are meaningful; masking the difference also handles wraparound
+    uint64_t ticks = ((timestamps[1] & timestampMask) - (timestamps[0] & timestampMask)) & timestampMask;
+    float frameMs = (float)ticks * timestampPeriod / 1000000.0f;
+    gpuFrameMs = gpuFrameMs == 0.0f ? frameMs : gpuFrameMs * 0.9f + frameMs * 0.1f;
+
+    //only rescale every few frames so the smoothed time can settle and re-records stay rare
+    if (++framesSinceScale < 30)
+    {
+        return;
+    }
+
+    float newScale = renderScale;
+    if (gpuFrameMs > gpuBudgetMs)
+    {
+        newScale = renderScale * 0.9f;
+    }
+    else if (gpuFrameMs < gpuBudgetMs * 0.75f)
+    {
+        newScale = renderScale * 1.05f;
+    }
+    newScale = newScale < 0.25f ? 0.25f : (newScale > 1.0f ? 1.0f : newScale);
+
+    VkExtent2D newExtent;
+    newExtent.width = (uint32_t)(screensize.width * newScale);
+    newExtent.height = (uint32_t)(screensize.height * newScale);
+    newExtent.width = newExtent.width ? newExtent.width : 1;
+    newExtent.height = newExtent.height ? newExtent.height : 1;
+
+    renderScale = newScale;
+    framesSinceScale = 0;
+
+    if (newExtent.width != renderExtent.width || newExtent.height != renderExtent.height)
+    {
+        renderExtent = newExtent;
+        if (printFrameStats)
+        {
+            std::cout << "GPU frame time " << gpuFrameMs << " ms, render scale " << renderScale
+                      << " (" << renderExtent.width << "x" << renderExtent.height << ") \n";
+        }
+    }
+}
+
+void chickenRenderer::markCommandBuffersDirty()
+{
+    for (uint32_t i = 0; i < scImgCount; i++)
+    {
+        cmdDirty[i] = true;
+    }
+}
+
+void chickenRenderer::recordCommandBuffer(VkCommandBuffer cmd, uint32_t imgIdx)
+{
     VkCommandBufferBeginInfo beginInfo = {};
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    beginInfo.flags = reuseCommandBuffers ? 0 : VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
     
         
     if(vkBeginCommandBuffer(cmd, &beginInfo) != VK_SUCCESS)
@@ -505,14 +808,22 @@ bool chickenRenderer::vk_render()
         std::cout << "Command buffer creation failed \n" << std::endl;
     }
 
+    if (timestampsSupported)
+    {
+        vkCmdResetQueryPool(cmd, timestampPool, 2 * imgIdx, 2);
+        //COLOR_ATTACHMENT_OUTPUT is where the acquire semaphore is waited on, so time spent
+        //waiting for the presentation engine is not counted as GPU work
+        vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, timestampPool, 2 * imgIdx);
+    }
+
     VkClearValue clearValue = {}; 
     clearValue.color = {0, 0, 0, 1};
 
     VkRenderPassBeginInfo rpBeginInfo = {};
     rpBeginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
     rpBeginInfo.renderPass = renderpass;
-    rpBeginInfo.renderArea.extent = screensize;
-    rpBeginInfo.framebuffer = framebuffers[imgIdx];
+    rpBeginInfo.renderArea.extent = renderExtent;
+    rpBeginInfo.framebuffer = offscreenFramebuffer;
     rpBeginInfo.pClearValues = &clearValue;
     rpBeginInfo.clearValueCount = 1;
 
@@ -521,11 +832,11 @@ bool chickenRenderer::vk_render()
 
     {
         VkRect2D scissor = {};
-        scissor.extent = screensize;
+        scissor.extent = renderExtent;
 
         VkViewport viewport = {};
-        viewport.width = screensize.width;
-        viewport.height = screensize.height;
+        viewport.width = renderExtent.width;
+        viewport.height = renderExtent.height;
         viewport.maxDepth = 1.0f;
 
         vkCmdSetScissor(cmd, 0, 1, &scissor);
@@ -537,7 +848,149 @@ bool chickenRenderer::vk_render()
 
     vkCmdEndRenderPass(cmd);
 
+    //Upscale the rendered region into the swapchain image
+    {
+        VkImageMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = scImages[imgIdx];
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        barrier.subresourceRange.layerCount = 1;
+        barrier.subresourceRange.levelCount = 1;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+
+        //srcStage matches the acquire semaphore wait stage so the transition happens after acquire
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             0, 0, 0, 0, 0, 1, &barrier);
+
+        if (blitSupported)
+        {
+            VkImageBlit blit = {};
+            blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            blit.srcSubresource.layerCount = 1;
+            blit.srcOffsets[1].x = renderExtent.width;
+            blit.srcOffsets[1].y = renderExtent.height;
+            blit.srcOffsets[1].z = 1;
+            blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            blit.dstSubresource.layerCount = 1;
+            blit.dstOffsets[1].x = screensize.width;
+            blit.dstOffsets[1].y = screensize.height;
+            blit.dstOffsets[1].z = 1;
+
+            vkCmdBlitImage(cmd, offscreenImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           scImages[imgIdx], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, blitFilter);
+        }
+        else
+        {
+            //renderExtent never shrinks without blit support, so a 1:1 copy covers the whole image
+            VkImageCopy copy = {};
+            copy.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            copy.srcSubresource.layerCount = 1;
+            copy.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            copy.dstSubresource.layerCount = 1;
+            copy.extent.width = screensize.width;
+            copy.extent.height = screensize.height;
+            copy.extent.depth = 1;
+
+            vkCmdCopyImage(cmd, offscreenImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           scImages[imgIdx], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy);
+        }
+
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = 0;
+
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                             0, 0, 0, 0, 0, 1, &barrier);
+    }
+
+    if (timestampsSupported)
+    {
+        vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampPool, 2 * imgIdx + 1);
+    }
+
     vkEndCommandBuffer(cmd);
+}
+
+bool chickenRenderer::vk_render()
+{
+    auto waitStart = std::chrono::steady_clock::now();
+
+    //the slot's acquire semaphore is free again once its last submission has completed
+    sync.wait(frameValues[frameSlot]);
+
+    //deferred frees run here, so they are counted as CPU work
+    auto collectStart = std::chrono::steady_clock::now();
+    sync.collect();
+    auto acquireStart = std::chrono::steady_clock::now();
+    cpuFrameTime += acquireStart - collectStart;
+    waitFrameTime += collectStart - waitStart;
+
+    VkSemaphore acquireSemaphore = acquireSemaphores[frameSlot];
+
+    uint32_t imgIdx;
+    VkResult acquireResult = vkAcquireNextImageKHR(device, swapchain, UINT64_MAX, acquireSemaphore, 0, &imgIdx);
+    if (acquireResult != VK_SUCCESS && acquireResult != VK_SUBOPTIMAL_KHR)
+    {
+        std::cout << "Failed to acquire swapchain image \n" << std::endl;
+        return false;
+    }
+
+    VkSemaphore submitSemaphore = submitSemaphores[imgIdx];
+
+    //this image's command buffer and timestamp queries may still be in flight from its last frame
+    if (imageValues[imgIdx] != 0)
+    {
+        sync.wait(imageValues[imgIdx]);
+        updateRenderScale(imgIdx);
+    }
+
+    auto frameStart = std::chrono::steady_clock::now();
+    waitFrameTime += frameStart - acquireStart;
+
+    VkCommandBuffer cmd;
+
+    if (reuseCommandBuffers)
+    {
+        //a recorded buffer is stale if the scene was marked dirty or the pipeline/extents it baked in changed
+        if (cmdPipeline[imgIdx] != pipeline ||
+            cmdExtent[imgIdx].width != screensize.width ||
+            cmdExtent[imgIdx].height != screensize.height ||
+            cmdRenderExtent[imgIdx].width != renderExtent.width ||
+            cmdRenderExtent[imgIdx].height != renderExtent.height)
+        {
+            cmdDirty[imgIdx] = true;
+        }
+
+        cmd = commandBuffers[imgIdx];
+
+        if (cmdDirty[imgIdx])
+        {
+            vkResetCommandBuffer(cmd, 0);
+            recordCommandBuffer(cmd, imgIdx);
+            cmdPipeline[imgIdx] = pipeline;
+            cmdExtent[imgIdx] = screensize;
+            cmdRenderExtent[imgIdx] = renderExtent;
+            cmdDirty[imgIdx] = false;
+        }
+    }
+    else
+    {
+        VkCommandBufferAllocateInfo allocInfo = {};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandBufferCount = 1;
+        allocInfo.commandPool = commandPool;
+        if(vkAllocateCommandBuffers(device, &allocInfo, &cmd) != VK_SUCCESS)
+        {
+            std::cout << "Failed to allocate command buffer \n" << std::endl;
+        }
+
+        recordCommandBuffer(cmd, imgIdx);
+    }
 
     VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
 
@@ -551,11 +1004,28 @@ bool chickenRenderer::vk_render()
     submitInfo.pWaitSemaphores = &acquireSemaphore;
     submitInfo.waitSemaphoreCount = 1;
 
-    if(vkQueueSubmit(graphicsQueue, 1, &submitInfo, 0) != VK_SUCCESS)
+    uint64_t value = sync.submit(graphicsQueue, submitInfo);
+    if (value == 0)
     {
-        std::cout << "Failed to submit queue \n" << std::endl;
+        //submitSemaphore will never be signaled, so the image must not be presented
+        if (!reuseCommandBuffers)
+        {
+            vkFreeCommandBuffers(device, commandPool, 1, &cmd);
+        }
+        return false;
     }
-   
+    frameValues[frameSlot] = value;
+    imageValues[imgIdx] = value;
+
+    if (!reuseCommandBuffers)
+    {
+        sync.deferUntil(value, [this, cmd]() {
+            vkFreeCommandBuffers(device, commandPool, 1, &cmd);
+        });
+    }
+
+    auto presentStart = std::chrono::steady_clock::now();
+    cpuFrameTime += presentStart - frameStart;
 
     VkPresentInfoKHR presentInfo = {};
     presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -566,9 +1036,20 @@ bool chickenRenderer::vk_render()
     presentInfo.waitSemaphoreCount = 1;
     vkQueuePresentKHR(graphicsQueue, &presentInfo);
 
-    vkDeviceWaitIdle(device);
+    waitFrameTime += std::chrono::steady_clock::now() - presentStart;
+
+    if (printFrameStats && ++timedFrames == 1000)
+    {
+        double avgUs = std::chrono::duration<double, std::micro>(cpuFrameTime).count() / timedFrames;
+        double waitUs = std::chrono::duration<double, std::micro>(waitFrameTime).count() / timedFrames;
+        std::cout << (reuseCommandBuffers ? "[reused cmd] " : "[recorded cmd] ")
+                  << "avg CPU frame time: " << avgUs << " us, blocked: " << waitUs << " us \n";
+        cpuFrameTime = std::chrono::steady_clock::duration::zero();
+        waitFrameTime = std::chrono::steady_clock::duration::zero();
+        timedFrames = 0;
+    }
 
-    vkFreeCommandBuffers(device, commandPool, 1, &cmd);
+    frameSlot = (frameSlot + 1) % framesInFlight;
 
     return true;
 }
@@ -6,6 +6,9 @@
 #include <iostream>
 #include <string>
 #include <fstream>
+#include <chrono>
+
+#include "vulkan_sync.hpp"
 
 namespace chicken {
 
@@ -14,6 +17,7 @@ namespace chicken {
         chickenRenderer();
         ~chickenRenderer();
         bool vk_render();
+        void markCommandBuffersDirty();
 
 
         private:
@@ -26,8 +30,18 @@ namespace chicken {
         VkSurfaceFormatKHR surfaceFormat;
         VkQueue graphicsQueue;
         VkCommandPool commandPool;
-        VkSemaphore submitSemaphore;
-        VkSemaphore acquireSemaphore;
+        //Acquire semaphores per frame in flight; present semaphores per swapchain image, since only
+        //reacquiring an image proves its previous present has finished waiting
+        static const uint32_t framesInFlight = 2;
+        VkSemaphore acquireSemaphores[framesInFlight];
+        std::vector<VkSemaphore> submitSemaphores;
+        uint64_t frameValues[framesInFlight];
+        uint32_t frameSlot;
+
+        //Submission values; the CPU waits on these instead of idling the device
+        chickenSync sync;
+        uint32_t instanceVersion;
+        bool timelineSupported;
         VkDebugUtilsMessengerEXT debugMessenger;
         VkRenderPass renderpass;
         VkExtent2D screensize;
@@ -37,9 +51,44 @@ namespace chicken {
         int graphicsIdx;
 
         uint32_t scImgCount;
-        VkImage scImages[5] ;
-        VkImageView scImageViews[5];
-        VkFramebuffer framebuffers[5];
+        std::vector<VkImage> scImages;
+
+        //Scene is rendered into a max-size offscreen target at renderExtent, then blitted to the swapchain image
+        VkImage offscreenImage;
+        VkDeviceMemory offscreenMemory;
+        VkImageView offscreenView;
+        VkFramebuffer offscreenFramebuffer;
+        VkExtent2D renderExtent;
+
+        //Dynamic resolution: renderScale follows the GPU frame time measured with timestamp queries,
+        //two per swapchain image so a result is only read back once that image's submission completes
+        VkQueryPool timestampPool;
+        bool timestampsSupported;
+        uint64_t timestampMask;
+        float timestampPeriod;
+        //without blit support the target is copied 1:1 and renderScale stays at 1
+        bool blitSupported;
+        VkFilter blitFilter;
+        float gpuBudgetMs;
+        float gpuFrameMs;
+        float renderScale;
+        uint32_t framesSinceScale;
+
+        //Pre-recorded command buffer per swapchain image, re-recorded only when dirty
+        bool reuseCommandBuffers;
+        std::vector<VkCommandBuffer> commandBuffers;
+        std::vector<bool> cmdDirty;
+        std::vector<VkPipeline> cmdPipeline;
+        std::vector<VkExtent2D> cmdExtent;
+        std::vector<VkExtent2D> cmdRenderExtent;
+        std::vector<uint64_t> imageValues;
+
+        //CPU time spent recording, submitting and freeing in vk_render, and separately the time
+        //blocked in acquire, present and submission-value waits; printed when printFrameStats is set
+        bool printFrameStats;
+        std::chrono::steady_clock::duration cpuFrameTime;
+        std::chrono::steady_clock::duration waitFrameTime;
+        uint32_t timedFrames;
 
         static std::vector<char> readFile(const std::string &filepath);
         void createInstance();
@@ -47,5 +96,8 @@ namespace chicken {
         bool pickPhysicalDevice();
         void createLogicalDevice();
         void createSwapChain();
+        void recordCommandBuffer(VkCommandBuffer cmd, uint32_t imgIdx);
+        uint32_t findMemoryType(uint32_t typeBits, VkMemoryPropertyFlags properties);
+        void updateRenderScale(uint32_t imgIdx);
     };
 }
@@ -0,0 +1,232 @@
+#include "vulkan_sync.hpp"
+
+#include <stdexcept>
+#include <iostream>
+#include <cstdint>
+
+using namespace chicken;
+
+void chickenSync::init(VkDevice dev, bool useTimeline)
+{
+    device = dev;
+    timeline = useTimeline;
+
+    if (timeline)
+    {
+        pfnWaitSemaphores = (PFN_vkWaitSemaphores)vkGetDeviceProcAddr(device, "vkWaitSemaphores");
+        pfnGetSemaphoreCounterValue = (PFN_vkGetSemaphoreCounterValue)vkGetDeviceProcAddr(device, "vkGetSemaphoreCounterValue");
+        timeline = pfnWaitSemaphores && pfnGetSemaphoreCounterValue;
+    }
+
+    if (timeline)
+    {
+        VkSemaphoreTypeCreateInfo typeInfo = {};
+        typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+        typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+        typeInfo.initialValue = 0;
+
+        VkSemaphoreCreateInfo semaInfo = {};
+        semaInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        semaInfo.pNext = &typeInfo;
+
+        if (vkCreateSemaphore(device, &semaInfo, 0, &timelineSemaphore) != VK_SUCCESS)
+        {
+            std::cout << "Failed to create timeline semaphore, falling back to fences \n" << std::endl;
+            timeline = false;
+        }
+    }
+
+    std::cout << (timeline ? "Synchronization using timeline semaphore \n"
+                           : "Synchronization using fences \n");
+}
+
+void chickenSync::destroy()
+{
+    waitIdle();
+    collect();
+
+    if (timelineSemaphore)
+    {
+        vkDestroySemaphore(device, timelineSemaphore, 0);
+        timelineSemaphore = VK_NULL_HANDLE;
+    }
+
+    for (VkFence fence : freeFences)
+    {
+        vkDestroyFence(device, fence, 0);
+    }
+    freeFences.clear();
+}
+
+uint64_t chickenSync::submit(VkQueue queue, const VkSubmitInfo &submitInfo)
+{
+    uint64_t value = lastValue + 1;
+    VkSubmitInfo info = submitInfo;
+    VkFence fence = VK_NULL_HANDLE;
+
+    //kept alive until vkQueueSubmit returns; stack storage keeps the per-frame path allocation free
+    VkSemaphore signalSemaphores[maxSignalSemaphores + 1];
+    uint64_t signalValues[maxSignalSemaphores + 1];
+    VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+
+    if (timeline)
+    {
+        uint32_t count = info.signalSemaphoreCount;
+        if (count > maxSignalSemaphores)
+        {
+            throw std::runtime_error("too many signal semaphores for one submission!");
+        }
+
+        //binary semaphores ignore their value, but the counts must match
+        for (uint32_t i = 0; i < count; i++)
+        {
+            signalSemaphores[i] = info.pSignalSemaphores[i];
+            signalValues[i] = 0;
+        }
+        signalSemaphores[count] = timelineSemaphore;
+        signalValues[count] = value;
+
+        timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timelineInfo.pNext = info.pNext;
+        timelineInfo.signalSemaphoreValueCount = count + 1;
+        timelineInfo.pSignalSemaphoreValues = signalValues;
+
+        info.pNext = &timelineInfo;
+        info.signalSemaphoreCount = count + 1;
+        info.pSignalSemaphores = signalSemaphores;
+    }
+    else
+    {
+        fence = acquireFence();
+    }
+
+    if (vkQueueSubmit(queue, 1, &info, fence) != VK_SUCCESS)
+    {
+        std::cout << "Failed to submit queue \n" << std::endl;
+        if (fence)
+        {
+            freeFences.push_back(fence);
+        }
+        return 0;
+    }
+
+    if (fence)
+    {
+        pendingFences.push_back({value, fence});
+    }
+
+    lastValue = value;
+    return value;
+}
+
+uint64_t chickenSync::completedValue()
+{
+    if (timeline)
+    {
+        pfnGetSemaphoreCounterValue(device, timelineSemaphore, &completed);
+    }
+    else
+    {
+        while (!pendingFences.empty() && vkGetFenceStatus(device, pendingFences.front().fence) == VK_SUCCESS)
+        {
+            retireFront();
+        }
+    }
+    return completed;
+}
+
+bool chickenSync::isComplete(uint64_t value)
+{
+    return value <= completed || value <= completedValue();
+}
+
+void chickenSync::wait(uint64_t value)
+{
+    if (value <= completed)
+    {
+        return;
+    }
+
+    if (timeline)
+    {
+        VkSemaphoreWaitInfo waitInfo = {};
+        waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+        waitInfo.semaphoreCount = 1;
+        waitInfo.pSemaphores = &timelineSemaphore;
+        waitInfo.pValues = &value;
+        if (pfnWaitSemaphores(device, &waitInfo, UINT64_MAX) != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed to wait for timeline semaphore!");
+        }
+        completedValue();
+    }
+    else
+    {
+        //fences signal in submission order, so retire them up to the one for value
+        while (!pendingFences.empty() && pendingFences.front().value <= value)
+        {
+            //never retire on failure, e.g. device lost, or deferred work would run too early
+            if (vkWaitForFences(device, 1, &pendingFences.front().fence, VK_TRUE, UINT64_MAX) != VK_SUCCESS)
+            {
+                throw std::runtime_error("failed to wait for fence!");
+            }
+            retireFront();
+        }
+    }
+}
+
+void chickenSync::waitIdle()
+{
+    wait(lastValue);
+}
+
+void chickenSync::deferUntil(uint64_t value, std::function<void()> fn)
+{
+    if (isComplete(value))
+    {
+        fn();
+        return;
+    }
+    deferred.push_back({value, std::move(fn)});
+}
+
+void chickenSync::collect()
+{
+    uint64_t done = completedValue();
+
+    //values are pushed in non-decreasing order, so stop at the first one still pending
+    while (!deferred.empty() && deferred.front().value <= done)
+    {
+        deferred.front().fn();
+        deferred.pop_front();
+    }
+}
+
+VkFence chickenSync::acquireFence()
+{
+    VkFence fence;
+    if (!freeFences.empty())
+    {
+        fence = freeFences.back();
+        freeFences.pop_back();
+        return fence;
+    }
+
+    VkFenceCreateInfo fenceInfo = {};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    if (vkCreateFence(device, &fenceInfo, 0, &fence) != VK_SUCCESS)
+    {
+        throw std::runtime_error("failed to create fence!");
+    }
+    return fence;
+}
+
+void chickenSync::retireFront()
+{
+    pendingFence front = pendingFences.front();
+    pendingFences.pop_front();
+
+    completed = front.value;
+    vkResetFences(device, 1, &front.fence);
+    freeFences.push_back(front.fence);
+}
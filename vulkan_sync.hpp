@@ -0,0 +1,60 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+#include <vector>
+#include <deque>
+#include <functional>
+
+namespace chicken {
+
+    //Every queue submission gets a monotonically increasing value, starting at 1;
+    //submit() returns 0 if the submission failed. Work can be waited on, queried,
+    //or have cleanup deferred against that value. Backed by a Vulkan 1.2 timeline
+    //semaphore, or one fence per submission when unavailable.
+    class chickenSync{
+        public:
+        void init(VkDevice device, bool useTimeline);
+        void destroy();
+
+        uint64_t submit(VkQueue queue, const VkSubmitInfo &submitInfo);
+        uint64_t completedValue();
+        bool isComplete(uint64_t value);
+        void wait(uint64_t value);
+        void waitIdle();
+        uint64_t lastSubmittedValue() const { return lastValue; }
+
+        void deferUntil(uint64_t value, std::function<void()> fn);
+        void collect();
+
+
+        private:
+        struct pendingFence {
+            uint64_t value;
+            VkFence fence;
+        };
+
+        struct deferredTask {
+            uint64_t value;
+            std::function<void()> fn;
+        };
+
+        static const uint32_t maxSignalSemaphores = 8;
+
+        VkDevice device = VK_NULL_HANDLE;
+        bool timeline = false;
+        VkSemaphore timelineSemaphore = VK_NULL_HANDLE;
+        PFN_vkWaitSemaphores pfnWaitSemaphores = nullptr;
+        PFN_vkGetSemaphoreCounterValue pfnGetSemaphoreCounterValue = nullptr;
+
+        uint64_t lastValue = 0;
+        uint64_t completed = 0;
+
+        std::deque<pendingFence> pendingFences;
+        std::vector<VkFence> freeFences;
+        std::deque<deferredTask> deferred;
+
+        VkFence acquireFence();
+        void retireFront();
+    };
+}